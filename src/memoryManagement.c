@@ -5,12 +5,23 @@
 */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 #include "memoryManagement.h"
 
+#ifdef LIGHT_MALLOC_USDT
+#include <sys/sdt.h>
+#endif
+
 // Define the type bool. 
 typedef int bool;
 #define true 1
@@ -19,7 +30,7 @@ typedef int bool;
 /**
  * MACROS
  */
-#define MMAP(lenght) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)
+#define MMAP(length, flags) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | flags, -1, 0)
 #define ADDRESS_PLUS_OFFSET(address, offset) address + sizeof(offset)
 #define ADDRESS_MINUS_OFFSET(address, offset) address - sizeof(offset)
 #define GET_FLAG(attribute) attribute & MSB_TO_ONE
@@ -33,6 +44,36 @@ typedef int bool;
 
 #define INIT_STRUCT(type, address) (struct type*) address
 
+/**
+ * TRACING
+ * Static tracepoints are compiled in with LIGHT_MALLOC_USDT,
+ * latency histograms with LIGHT_MALLOC_TRACE.
+ * Otherwise these macros expand to nothing.
+ */
+#ifdef LIGHT_MALLOC_USDT
+#define TRACE_PROBE(name, arg) DTRACE_PROBE1(lightmalloc, name, arg)
+#else
+#define TRACE_PROBE(name, arg)
+#endif
+
+#ifdef LIGHT_MALLOC_TRACE
+#define TRACE_START(start) uint64_t start = traceClock()
+#define TRACE_END(path, start) recordLatency(path, traceClock() - start)
+#define TRACE_SET_ALLOCATION_PATH(path) allocationPath = path
+// Keep the slowest path taken by the current allocation.
+#define TRACE_ALLOCATION_PATH(path) do { if (path > allocationPath) allocationPath = path; } while (0)
+// Allocations made by pressure callbacks must not overwrite the path of the outer one.
+#define TRACE_SAVE_ALLOCATION_PATH(saved) LATENCY_PATH saved = allocationPath
+#define TRACE_RESTORE_ALLOCATION_PATH(saved) allocationPath = saved
+#else
+#define TRACE_START(start)
+#define TRACE_END(path, start)
+#define TRACE_SET_ALLOCATION_PATH(path)
+#define TRACE_ALLOCATION_PATH(path)
+#define TRACE_SAVE_ALLOCATION_PATH(saved)
+#define TRACE_RESTORE_ALLOCATION_PATH(saved)
+#endif
+
 /**
  * MASKS
  */
@@ -45,6 +86,10 @@ const uint32_t MSB_TO_ZERO = 0;
 // Constants
 static const int DEFAULT_NUMBER_MMAP_PAGES = 1024; // size Page size varies from system to system.
 static const double WORD_SIZE = 4.0; // Assumption.
+static const int DEFAULT_NUMBER_HANDLES = 64;
+#define MAX_PRESSURE_CALLBACKS 8
+static const uint64_t PERSISTENT_HEAP_MAGIC = 0x4c4d414c4c4f4331; // "LMALLOC1"
+static const uint32_t PERSISTENT_HEAP_VERSION = 1;
 
 // Static variables
 static int thereIsAnMmapRegion = 0;
@@ -52,6 +97,7 @@ static int thereIsAnMmapRegion = 0;
 int numberFreeBlocks = 0;
 uint64_t totalFreeSpace = 0;
 int currentAllocatedMemory= 0;
+uint64_t totalMappedMemory = 0;
 
 // If larger block, just update. If block of size -largestFreeBlock- is 
 // freed, then loop through all the free list to find the new largest free region.
@@ -63,6 +109,32 @@ static void* newMmapRegion = NULL;
 static void* freeList = NULL;
 static void* mmapsList = NULL;
 
+// Handles
+static struct handleEntry* handleTable = NULL;
+static int handleTableCapacity = 0;
+static memoryHandle firstFreeHandle = INVALID_MEMORY_HANDLE;
+static int compactionCursor = 0;
+
+// Limits on totalMappedMemory, 0 if not set.
+static uint64_t softMemoryLimit = 0;
+static uint64_t hardMemoryLimit = 0;
+static memoryPressureCallback pressureCallbacks[MAX_PRESSURE_CALLBACKS];
+static void* pressureCallbackContexts[MAX_PRESSURE_CALLBACKS];
+static int numberPressureCallbacks = 0;
+static bool notifyingMemoryPressure = false;
+// Set once the callbacks ran for the current allocation.
+static bool memoryPressureRelieved = false;
+
+// Persistent heap, NULL if not open.
+static struct persistentHeapHeader* persistentHeap = NULL;
+static int persistentHeapFile = -1;
+
+#ifdef LIGHT_MALLOC_TRACE
+// Bucket i counts the latencies in [2^i, 2^(i+1)) nanoseconds.
+static uint64_t latencyHistograms[NUMBER_LATENCY_PATHS][NUMBER_LATENCY_BUCKETS];
+static LATENCY_PATH allocationPath = LATENCY_GET_MEMORY_FAST_HIT;
+#endif
+
 /*
  * STRUCTS
  */
@@ -85,6 +157,31 @@ struct blockHeader {
 	uint32_t attribute;
 } blockHeader;
 
+// First page of a persistent heap file. The mmap region follows it.
+// The heap is always mapped at baseAddress, so that the links between
+// blocks and the pointers stored by the user stay valid across processes.
+struct persistentHeapHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t state;
+	void* baseAddress;
+	uint64_t length; // in bytes, including this header.
+	void* root;
+	// Allocator state, valid if state is PERSISTENT_HEAP_CLEAN.
+	void* freeList;
+	int numberFreeBlocks;
+	uint64_t totalFreeSpace;
+	int largestFreeBlock;
+	int currentAllocatedMemory;
+} persistentHeapHeader;
+
+// block is NULL if the handle is not in use.
+struct handleEntry {
+	void* block;
+	uint32_t lockCount;
+	memoryHandle nextFreeHandle;
+} handleEntry;
+
 /*
  * Enumerators
  */
@@ -96,9 +193,25 @@ struct blockHeader {
  	NEIGHBOUR_BLOCKS_BOTH_FREE
  } NEIGHBOUR_BLOCKS;
 
+// DIRTY while the heap is open, CLEAN once it has been closed.
+ typedef enum 
+ {
+ 	PERSISTENT_HEAP_CLEAN,
+ 	PERSISTENT_HEAP_DIRTY
+ } PERSISTENT_HEAP_STATE;
+
 // Prototypes
-void mmapRegion(uint64_t size);
+bool mmapRegion(uint64_t size, int reserveFlags);
+void notifyMemoryPressure();
+bool relieveMemoryPressure(uint64_t size);
+uint64_t mmapRegionLength(uint64_t size);
+void installMmapRegion(void* region, uint64_t length);
+bool recoverPersistentHeap(uint64_t length);
+void savePersistentHeapState();
+void resetHeapState();
+void touchMmapRegion(void* region, uint64_t length);
 void *getFreeBlock(uint64_t size);
+void *allocateFreeBlock(void* currentFreeBlock, uint32_t size);
 void initialiseFreeBlock(void* freeRegion, uint32_t size, void* prevFreeRegion, 
 	void* nextFreeRegion, bool flag, bool setHeader);
 void insertFreeBlock(void* newBlock, struct freeBlockLinks *prevBlockLinks);
@@ -123,6 +236,17 @@ void coalesceWithNextBlock(void* newAddr, uint32_t newSize,
 void coalesceWithPrevBlock(void* newAddr, uint32_t newSize);
 void updateNextBlockOnCoalescing(void* newAddr, uint64_t sizeOffset);
 void setFooterBlockOnCoalescing(void* newAddr, uint64_t sizeOffset, uint32_t newSize);
+bool growHandleTable();
+bool isValidHandle(memoryHandle handle);
+bool moveHandleBlock(struct handleEntry *entry);
+void *findLowerFreeBlock(void* block, uint32_t size);
+void removeFreeBlock(void* block);
+bool isInFreeList(void* block);
+bool trimMmapRegion(void* mmapRegion, void* prevMmapRegion);
+#ifdef LIGHT_MALLOC_TRACE
+uint64_t traceClock();
+void recordLatency(LATENCY_PATH path, uint64_t latency);
+#endif
 
 /** 
  *
@@ -132,17 +256,29 @@ void setFooterBlockOnCoalescing(void* newAddr, uint64_t sizeOffset, uint32_t new
 
 void *getMemory(int size) 
 {
-    
+	TRACE_START(start);
 	if (size > (UPPER_LIMIT_SIZE * WORD_SIZE) || size < LOWER_LIMIT_SIZE) {
 		printf("Size is out of bounds \n");
+		TRACE_END(LATENCY_GET_MEMORY, start);
 		return NULL;
 	}
+	TRACE_SET_ALLOCATION_PATH(LATENCY_GET_MEMORY_FAST_HIT);
+
+	// Allocations made by the pressure callbacks do not notify them again.
+	if (!notifyingMemoryPressure)
+		memoryPressureRelieved = false;
+
 	/*
 	 Check if it's first request of memory allocation.
 	 If so then mmap
 	*/
 	if (!thereIsAnMmapRegion) {
-		mmapRegion(size);
+		relieveMemoryPressure(size);
+		if (!mmapRegion(size, 0)) {
+			TRACE_END(LATENCY_GET_MEMORY, start);
+			TRACE_END(allocationPath, start);
+			return NULL;
+		}
 		thereIsAnMmapRegion = 1;
 	}
 	
@@ -158,6 +294,8 @@ void *getMemory(int size)
 	if (block)
 		currentAllocatedMemory += size; // From user perspective.
 
+	TRACE_END(LATENCY_GET_MEMORY, start);
+	TRACE_END(allocationPath, start);
 	return block;
 }
 
@@ -167,6 +305,7 @@ void freeMemory(void *ptr)
 	Read flag for coalescing with previous block
 	Read size to get to the next block and check if it's free (coalescing)
 	*/
+	TRACE_START(start);
 	void *startBlock = ADDRESS_MINUS_OFFSET(ptr, blockHeader);
 	struct blockHeader *header = INIT_STRUCT(blockHeader, startBlock);
 	uint32_t size = GET_SIZE(header->attribute); // in words
@@ -176,32 +315,460 @@ void freeMemory(void *ptr)
 		freeList = startBlock;
 		numberFreeBlocks++;
 
+		// Tell next block that its previous one is NOW free.
+		updateNextBlockOnCoalescing(startBlock, WORDS_TO_BYTES(size));
+
 		totalFreeSpace += WORDS_TO_BYTES(size); // Stats
 	} else {
 		coalescingAndFree(startBlock);
 	}
 
 	currentAllocatedMemory -= WORDS_TO_BYTES(size);
+	TRACE_END(LATENCY_FREE_MEMORY, start);
 }
 
-void mmapRegion(uint64_t size) 
+void *getMemoryWithSize(int size, int *usableSize)
+{
+	void* block = getMemory(size);
+	if (usableSize)
+		*usableSize = getUsableSize(block);
+
+	return block;
+}
+
+int getUsableSize(void *ptr)
+{
+	if (!ptr)
+		return 0;
+
+	void *startBlock = ADDRESS_MINUS_OFFSET(ptr, blockHeader);
+	struct blockHeader *header = INIT_STRUCT(blockHeader, startBlock);
+	uint32_t size = GET_SIZE(header->attribute); // in words
+	return WORDS_TO_BYTES(size);
+}
+
+int goodSize(int size)
+{
+	if (size > (UPPER_LIMIT_SIZE * WORD_SIZE) || size < LOWER_LIMIT_SIZE)
+		return 0;
+
+	// Same rounding as getFreeBlock() and allocateBlock() when splitting.
+	uint32_t sizeInWords = BYTES_TO_WORDS(size);
+	if (!sufficientSize(sizeInWords))
+		sizeInWords = minimumSize() - BYTES_TO_WORDS(sizeof(freeBlockFooter));
+
+	return WORDS_TO_BYTES(sizeInWords);
+}
+
+int reserveMemory(uint64_t size, int flags)
+{
+	// The free region must fit in largestFreeBlock.
+	uint64_t overhead = sizeof(headerMmapRegion) + (2 * sizeof(blockHeader));
+	if (size < LOWER_LIMIT_SIZE || size > INT_MAX || mmapRegionLength(size) - overhead > INT_MAX) {
+		printf("Size is out of bounds \n");
+		return -1;
+	}
+
+	if (!mmapRegion(size, flags))
+		return -1;
+	thereIsAnMmapRegion = 1;
+
+	return 0;
+}
+
+memoryHandle allocHandle(int size)
+{
+	// Handles are not persisted, their blocks would leak in the heap file.
+	if (persistentHeap) {
+		fprintf(stderr, "memoryManagement.allocHandle - Not supported by persistent heaps\n");
+		return INVALID_MEMORY_HANDLE;
+	}
+
+	if (firstFreeHandle == INVALID_MEMORY_HANDLE && !growHandleTable())
+		return INVALID_MEMORY_HANDLE;
+
+	void* block = getMemory(size);
+	if (!block)
+		return INVALID_MEMORY_HANDLE;
+
+	memoryHandle handle = firstFreeHandle;
+	struct handleEntry *entry = &handleTable[handle];
+	firstFreeHandle = entry->nextFreeHandle;
+
+	entry->block = block;
+	entry->lockCount = 0;
+	entry->nextFreeHandle = INVALID_MEMORY_HANDLE;
+
+	return handle;
+}
+
+void *lockHandle(memoryHandle handle)
+{
+	if (!isValidHandle(handle)) {
+		fprintf(stderr, "memoryManagement.lockHandle - Invalid handle\n");
+		return NULL;
+	}
+
+	struct handleEntry *entry = &handleTable[handle];
+	entry->lockCount++;
+	return entry->block;
+}
+
+void unlockHandle(memoryHandle handle)
+{
+	if (!isValidHandle(handle) || !handleTable[handle].lockCount) {
+		fprintf(stderr, "memoryManagement.unlockHandle - Invalid handle\n");
+		return;
+	}
+
+	handleTable[handle].lockCount--;
+}
+
+void freeHandle(memoryHandle handle)
+{
+	if (!isValidHandle(handle)) {
+		fprintf(stderr, "memoryManagement.freeHandle - Invalid handle\n");
+		return;
+	}
+
+	// The address returned by lockHandle() is still in use.
+	if (handleTable[handle].lockCount) {
+		fprintf(stderr, "memoryManagement.freeHandle - Handle is locked\n");
+		return;
+	}
+
+	struct handleEntry *entry = &handleTable[handle];
+	freeMemory(entry->block);
+
+	entry->block = NULL;
+	entry->lockCount = 0;
+	entry->nextFreeHandle = firstFreeHandle;
+	firstFreeHandle = handle;
+}
+
+int compactMemory(int maxMoves)
+{
+	int numberMovedBlocks = 0;
+	int numberVisitedHandles = 0;
+
+	// Resume from the handle the previous call stopped at.
+	while (numberVisitedHandles < handleTableCapacity && numberMovedBlocks < maxMoves) {
+		struct handleEntry *entry = &handleTable[compactionCursor];
+		compactionCursor = (compactionCursor + 1) % handleTableCapacity;
+		numberVisitedHandles++;
+
+		if (entry->block && !entry->lockCount && moveHandleBlock(entry))
+			numberMovedBlocks++;
+	}
+
+	trimMemory();
+
+	return numberMovedBlocks;
+}
+
+void trimMemory()
+{
+	// The regions of a persistent heap stay mapped to the file.
+	if (persistentHeap)
+		return;
+
+	void* prevMmapRegion = NULL;
+	void* currentMmapRegion = mmapsList;
+	while (currentMmapRegion) {
+		struct headerMmapRegion *headerMmap = INIT_STRUCT(headerMmapRegion, currentMmapRegion);
+		void* nextMmapRegion = NEXT_MMAP_ADDRESS(headerMmap);
+
+		// The region stays in the list unless it was entirely free.
+		if (!trimMmapRegion(currentMmapRegion, prevMmapRegion))
+			prevMmapRegion = currentMmapRegion;
+		currentMmapRegion = nextMmapRegion;
+	}
+}
+
+void setMemoryLimits(uint64_t softLimit, uint64_t hardLimit)
+{
+	softMemoryLimit = softLimit;
+	hardMemoryLimit = hardLimit;
+}
+
+int registerPressureCallback(memoryPressureCallback callback, void* context)
+{
+	if (!callback || numberPressureCallbacks == MAX_PRESSURE_CALLBACKS) {
+		fprintf(stderr, "memoryManagement.registerPressureCallback - Cannot register callback\n");
+		return -1;
+	}
+
+	pressureCallbacks[numberPressureCallbacks] = callback;
+	pressureCallbackContexts[numberPressureCallbacks] = context;
+	numberPressureCallbacks++;
+	return 0;
+}
+
+// Trim the mmap regions, let the callbacks shed memory and trim again.
+// Callbacks can call getMemory() and freeMemory(), but are not notified again
+// while they are running.
+void notifyMemoryPressure()
+{
+	if (notifyingMemoryPressure)
+		return;
+	notifyingMemoryPressure = true;
+
+	trimMemory();
+
+	TRACE_SAVE_ALLOCATION_PATH(savedAllocationPath);
+	int i;
+	for (i = 0; i < numberPressureCallbacks; i++) {
+		pressureCallbacks[i](totalMappedMemory, pressureCallbackContexts[i]);
+	}
+	TRACE_RESTORE_ALLOCATION_PATH(savedAllocationPath);
+
+	// Unmap what the callbacks shed.
+	if (numberPressureCallbacks)
+		trimMemory();
+
+	notifyingMemoryPressure = false;
+}
+
+int openPersistentHeap(const char* path, uint64_t size)
+{
+	if (thereIsAnMmapRegion || mmapsList || handleTable) {
+		fprintf(stderr, "memoryManagement.openPersistentHeap - Memory already in use\n");
+		return PERSISTENT_HEAP_ERROR;
+	}
+
+	int file = open(path, O_RDWR | O_CREAT, 0600);
+	if (file == -1) {
+		fprintf(stderr, "memoryManagement.openPersistentHeap - Cannot open %s\n", path);
+		return PERSISTENT_HEAP_ERROR;
+	}
+
+	// Only one process can use the heap. The lock is released on close or exit.
+	if (flock(file, LOCK_EX | LOCK_NB) == -1) {
+		fprintf(stderr, "memoryManagement.openPersistentHeap - %s is in use\n", path);
+		close(file);
+		return PERSISTENT_HEAP_ERROR;
+	}
+
+	struct stat fileStat;
+	if (fstat(file, &fileStat) == -1) {
+		fprintf(stderr, "memoryManagement.openPersistentHeap - Cannot stat %s\n", path);
+		close(file);
+		return PERSISTENT_HEAP_ERROR;
+	}
+
+	uint64_t pageSize = sysconf(_SC_PAGE_SIZE);
+	bool newHeap = fileStat.st_size == 0;
+	void* baseAddress = NULL;
+	uint64_t length;
+	if (newHeap) {
+		// The free region must fit in largestFreeBlock.
+		length = ((size + pageSize - 1) / pageSize) * pageSize;
+		if (length < 2 * pageSize || length - pageSize > INT_MAX ||
+			ftruncate(file, length) == -1) {
+			fprintf(stderr, "memoryManagement.openPersistentHeap - Invalid size\n");
+			close(file);
+			return PERSISTENT_HEAP_ERROR;
+		}
+	} else {
+		struct persistentHeapHeader header;
+		if (pread(file, &header, sizeof(header), 0) != sizeof(header) ||
+			header.magic != PERSISTENT_HEAP_MAGIC || header.version != PERSISTENT_HEAP_VERSION ||
+			header.length != (uint64_t) fileStat.st_size) {
+			fprintf(stderr, "memoryManagement.openPersistentHeap - %s is not a heap file\n", path);
+			close(file);
+			return PERSISTENT_HEAP_ERROR;
+		}
+		baseAddress = header.baseAddress;
+		length = header.length;
+	}
+
+	int mmapFlags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+	if (baseAddress)
+		mmapFlags |= MAP_FIXED_NOREPLACE;
+#endif
+	void* heap = mmap(baseAddress, length, PROT_READ | PROT_WRITE, mmapFlags, file, 0);
+	if (heap != MAP_FAILED && baseAddress && heap != baseAddress) {
+		// Only a hint without MAP_FIXED_NOREPLACE.
+		munmap(heap, length);
+		heap = MAP_FAILED;
+		errno = EEXIST;
+	}
+	if (heap == MAP_FAILED) {
+		if (baseAddress && errno == EEXIST) {
+			fprintf(stderr, "memoryManagement.openPersistentHeap - Address %p of %s is in use\n", baseAddress, path);
+			close(file);
+			return PERSISTENT_HEAP_ADDRESS_IN_USE;
+		}
+		fprintf(stderr, "memoryManagement.openPersistentHeap - Cannot map %s\n", path);
+		close(file);
+		return PERSISTENT_HEAP_ERROR;
+	}
+
+	struct persistentHeapHeader *header = INIT_STRUCT(persistentHeapHeader, heap);
+	void* region = heap + pageSize;
+	if (newHeap) {
+		header->magic = PERSISTENT_HEAP_MAGIC;
+		header->version = PERSISTENT_HEAP_VERSION;
+		header->baseAddress = heap;
+		header->length = length;
+		header->root = NULL;
+
+		struct headerMmapRegion *headerMmap = INIT_STRUCT(headerMmapRegion, region);
+		NEXT_MMAP_ADDRESS(headerMmap) = NULL;
+		installMmapRegion(region, length - pageSize);
+		numberFreeBlocks++;
+	} else {
+		mmapsList = region;
+		if (header->state == PERSISTENT_HEAP_CLEAN) {
+			freeList = header->freeList;
+			numberFreeBlocks = header->numberFreeBlocks;
+			totalFreeSpace = header->totalFreeSpace;
+			largestFreeBlock = header->largestFreeBlock;
+			currentAllocatedMemory = header->currentAllocatedMemory;
+		} else if (!recoverPersistentHeap(length - pageSize)) {
+			// Not closed properly, and blocks are inconsistent.
+			fprintf(stderr, "memoryManagement.openPersistentHeap - %s is corrupted\n", path);
+			resetHeapState();
+			munmap(heap, length);
+			close(file);
+			return PERSISTENT_HEAP_ERROR;
+		}
+	}
+
+	header->state = PERSISTENT_HEAP_DIRTY;
+	msync(heap, pageSize, MS_SYNC);
+
+	persistentHeap = header;
+	persistentHeapFile = file;
+	thereIsAnMmapRegion = 1;
+	totalMappedMemory += length; // Stats
+
+	return 0;
+}
+
+void syncPersistentHeap()
+{
+	if (!persistentHeap)
+		return;
+
+	savePersistentHeapState();
+	msync(persistentHeap, persistentHeap->length, MS_SYNC);
+}
+
+void closePersistentHeap()
+{
+	if (!persistentHeap)
+		return;
+
+	uint64_t length = persistentHeap->length;
+	savePersistentHeapState();
+	msync(persistentHeap, length, MS_SYNC);
+
+	// Mark clean only once everything else is on disk.
+	persistentHeap->state = PERSISTENT_HEAP_CLEAN;
+	msync(persistentHeap, sysconf(_SC_PAGE_SIZE), MS_SYNC);
+
+	munmap(persistentHeap, length);
+	close(persistentHeapFile);
+	totalMappedMemory -= length; // Stats
+
+	resetHeapState();
+	persistentHeap = NULL;
+	persistentHeapFile = -1;
+}
+
+void setPersistentRoot(void* ptr)
+{
+	if (persistentHeap)
+		persistentHeap->root = ptr;
+}
+
+void *getPersistentRoot()
+{
+	return persistentHeap ? persistentHeap->root : NULL;
+}
+
+// Before mapping a region beyond the soft limit, let the callbacks shed memory,
+// once per allocation. Returns true if they ran, so the free list can be
+// searched again before mapping.
+bool relieveMemoryPressure(uint64_t size)
+{
+	if (!softMemoryLimit || memoryPressureRelieved || notifyingMemoryPressure)
+		return false;
+
+	if (totalMappedMemory + mmapRegionLength(size) <= softMemoryLimit)
+		return false;
+
+	notifyMemoryPressure();
+	memoryPressureRelieved = true;
+	return true;
+}
+
+// Length in bytes of the region to map for a request of -size- bytes.
+uint64_t mmapRegionLength(uint64_t size)
 {
-	uint64_t length; 
-	bool mmapRegionsCoalesced = false; 
 	// Make sure there's enough allocated memory.
 	if (DEFAULT_NUMBER_MMAP_PAGES * sysconf(_SC_PAGE_SIZE) - 
 		(sizeof(headerMmapRegion) + sizeof(blockHeader)) < size) {
 		uint64_t numberPages = (uint64_t) (size / sysconf(_SC_PAGE_SIZE)) + 1;
-		length = numberPages * sysconf(_SC_PAGE_SIZE);
-	} else {
-		length = DEFAULT_NUMBER_MMAP_PAGES * sysconf(_SC_PAGE_SIZE);
+		return numberPages * sysconf(_SC_PAGE_SIZE);
 	}
+	return DEFAULT_NUMBER_MMAP_PAGES * sysconf(_SC_PAGE_SIZE);
+}
+
+// reserveFlags are the RESERVE_MEMORY_* flags, 0 for lazy faulting.
+// Returns false if the region cannot be mapped.
+bool mmapRegion(uint64_t size, int reserveFlags) 
+{
+	uint64_t length; 
+	bool mmapRegionsCoalesced = false; 
+
+	TRACE_ALLOCATION_PATH(LATENCY_GET_MEMORY_NEW_MMAP);
+
+	// A persistent heap cannot grow.
+	if (persistentHeap)
+		return false;
+
+	length = mmapRegionLength(size);
+
+	// Map only what is left below the hard limit, if the request fits in it.
+	if (hardMemoryLimit && totalMappedMemory + length > hardMemoryLimit) {
+		uint64_t pageSize = sysconf(_SC_PAGE_SIZE);
+		uint64_t headroom = 0;
+		if (hardMemoryLimit > totalMappedMemory)
+			headroom = ((hardMemoryLimit - totalMappedMemory) / pageSize) * pageSize;
 
-	newMmapRegion = MMAP(length); // TODO: check for errors
+		uint64_t minimumLength = size + sizeof(headerMmapRegion) + 
+			(2 * sizeof(blockHeader)) + WORDS_TO_BYTES(minimumSize());
+		if (headroom < minimumLength)
+			return false;
+		length = headroom;
+	}
+
+	int mmapFlags = 0;
+#ifdef MAP_POPULATE
+	if (reserveFlags & RESERVE_MEMORY_POPULATE)
+		mmapFlags |= MAP_POPULATE;
+#else
+	// Fall back to touching the pages.
+	if (reserveFlags & RESERVE_MEMORY_POPULATE)
+		reserveFlags |= RESERVE_MEMORY_TOUCH;
+#endif
+
+	TRACE_PROBE(mmap_region_start, length);
+	TRACE_START(start);
+	newMmapRegion = MMAP(length, mmapFlags);
+	TRACE_END(LATENCY_MMAP_REGION, start);
+	TRACE_PROBE(mmap_region_done, newMmapRegion);
 	if (newMmapRegion == MAP_FAILED) {
 		fprintf(stderr, "memoryManagement.mmapRegion - Memory overflow\n");
-		exit(-1);
+		return false;
 	}
+	totalMappedMemory += length; // Stats
+
+	if (reserveFlags & RESERVE_MEMORY_TOUCH)
+		touchMmapRegion(newMmapRegion, length);
 
 	// 	Header Mmap region
 	struct headerMmapRegion *headerMmap = INIT_STRUCT(headerMmapRegion, newMmapRegion);
@@ -214,20 +781,41 @@ void mmapRegion(uint64_t size)
 	}
 
 	if(!mmapRegionsCoalesced) {
-		headerMmap->length = BYTES_TO_WORDS(length);
-		mmapsList = newMmapRegion; // Update the pointer of mmapsList.
+		installMmapRegion(newMmapRegion, length);
+	}
 
-		setMmapFooter(newMmapRegion, length);
+	numberFreeBlocks++; // Add one free block to the counter.
+	return true;
+}
 
+// Add a new region at the front of the mmaps list, as a single free block.
+// length in bytes
+void installMmapRegion(void* region, uint64_t length)
+{
+	struct headerMmapRegion *headerMmap = INIT_STRUCT(headerMmapRegion, region);
+	headerMmap->length = BYTES_TO_WORDS(length);
+	mmapsList = region; // Update the pointer of mmapsList.
 
-		// Set first free region.
-		void* beginningFreeRegion = ADDRESS_PLUS_OFFSET(newMmapRegion, headerMmapRegion); 
-		// header free region and footer mmap to be excluded.
-		uint64_t sizeFreeRegion = length - sizeof(headerMmapRegion) - (2 * sizeof(blockHeader)); 
-		initialiseFreeMmapRegion(beginningFreeRegion, sizeFreeRegion);
-	}
+	setMmapFooter(region, length);
 
-	numberFreeBlocks++; // Add one free block to the counter.
+	// Set first free region.
+	void* beginningFreeRegion = ADDRESS_PLUS_OFFSET(region, headerMmapRegion); 
+	// header free region and footer mmap to be excluded.
+	uint64_t sizeFreeRegion = length - sizeof(headerMmapRegion) - (2 * sizeof(blockHeader)); 
+	initialiseFreeMmapRegion(beginningFreeRegion, sizeFreeRegion);
+}
+
+// Fault in every page of a region. Writing back the byte just read
+// keeps any header already stored in the page.
+// length in bytes
+void touchMmapRegion(void* region, uint64_t length)
+{
+	uint64_t pageSize = sysconf(_SC_PAGE_SIZE);
+	volatile char* page = region;
+	uint64_t offset;
+	for (offset = 0; offset < length; offset += pageSize) {
+		page[offset] = page[offset];
+	}
 }
 
 // size free region in bytes
@@ -320,16 +908,21 @@ void *getFreeBlock(uint64_t requestedSize)
 	uint32_t size = BYTES_TO_WORDS(requestedSize);
 
 	if (!freeList) {
-	 	mmapRegion(requestedSize);
+	 	if (relieveMemoryPressure(requestedSize))
+	 		return getFreeBlock(requestedSize);
+	 	if (!mmapRegion(requestedSize, 0))
+	 		return NULL;
 	 	return getFreeBlock(requestedSize);
 	}
 
 	int numberTraversedNodes = 0;
 	bool freeBlockFound = false;
-	bool updateLargestFreeBlock = false;
 	void* freeBlock;
 	void* currentFreeBlock = freeList;
 
+	TRACE_PROBE(get_free_block_start, requestedSize);
+	TRACE_START(start);
+
 	/*
 	 Traverse free list (circular double linked list)
 	 Use next-fit.
@@ -342,37 +935,10 @@ void *getFreeBlock(uint64_t requestedSize)
 		struct freeBlockLinks *currentBlockLinks = INIT_STRUCT(freeBlockLinks, freeBlock);
 		if (sizeFreeRegion >= size) {
 			freeBlockFound = true;
-
-			int sizeFreeRegionInBytes =  WORDS_TO_BYTES(sizeFreeRegion);
-			// Larger blocks than largestFreeBlock can exist if mmap is called again.
-			if (sizeFreeRegionInBytes >= largestFreeBlock) {
-				updateLargestFreeBlock = true;
-			}
-
-			uint32_t spaceLeft; // in words
-			uint32_t minFreeRegionSize = minimumSize();
-			if (sufficientSize(size)) {
-				spaceLeft = sizeFreeRegion - size;
-			} else {
-				spaceLeft = sizeFreeRegion - minFreeRegionSize;
-			}
-
-			allocateBlock(size, spaceLeft, minFreeRegionSize, 
-				sizeFreeRegion, freeBlock, currentFreeBlock, currentBlockLinks);
-
-			// Remove allocated block.
-			if (numberFreeBlocks == 1) {
-				freeList = NULL;
-			} else {
-				removeAllocatedBlock(currentBlockLinks);
-			}
-			numberFreeBlocks--;
-
-			// Look for new largestFreeBlock
-			if(numberFreeBlocks && updateLargestFreeBlock) {
-				findAndSetLargestFreeBlock();
-			}
-
+			// The walk ends here, allocating is timed on its own.
+			TRACE_END(LATENCY_GET_FREE_BLOCK, start);
+			TRACE_PROBE(get_free_block_done, numberTraversedNodes + 1);
+			allocateFreeBlock(currentFreeBlock, size);
 		}
 		// Step to the next free block in the free list.
 		numberTraversedNodes++;
@@ -380,13 +946,63 @@ void *getFreeBlock(uint64_t requestedSize)
 	} while (numberTraversedNodes < numberFreeBlocks && !freeBlockFound);
 
 	if (!freeBlockFound) {
-	 	mmapRegion(requestedSize);
+		TRACE_END(LATENCY_GET_FREE_BLOCK, start);
+		TRACE_PROBE(get_free_block_done, numberTraversedNodes);
+	 	if (relieveMemoryPressure(requestedSize))
+	 		return getFreeBlock(requestedSize);
+	 	if (!mmapRegion(requestedSize, 0))
+	 		return NULL;
 	 	return getFreeBlock(requestedSize);
 	}
 
 	return freeBlock;
 }
 
+// Allocate a block of -size- words from the given free block
+// and remove the allocated part from the free list.
+void *allocateFreeBlock(void* currentFreeBlock, uint32_t size)
+{
+	bool updateLargestFreeBlock = false;
+	struct blockHeader *currentFreeRegionHeader = INIT_STRUCT(blockHeader, currentFreeBlock);
+	uint32_t sizeFreeRegion = GET_SIZE(currentFreeRegionHeader->attribute);
+
+	void* freeBlock = ADDRESS_PLUS_OFFSET(currentFreeBlock, blockHeader);
+	struct freeBlockLinks *currentBlockLinks = INIT_STRUCT(freeBlockLinks, freeBlock);
+
+	int sizeFreeRegionInBytes =  WORDS_TO_BYTES(sizeFreeRegion);
+	// Larger blocks than largestFreeBlock can exist if mmap is called again.
+	if (sizeFreeRegionInBytes >= largestFreeBlock) {
+		updateLargestFreeBlock = true;
+	}
+
+	uint32_t spaceLeft; // in words
+	uint32_t minFreeRegionSize = minimumSize();
+	if (sufficientSize(size)) {
+		spaceLeft = sizeFreeRegion - size;
+	} else {
+		// allocateBlock() hands out a minimum size block without footer.
+		spaceLeft = sizeFreeRegion - (minFreeRegionSize - BYTES_TO_WORDS(sizeof(freeBlockFooter)));
+	}
+
+	allocateBlock(size, spaceLeft, minFreeRegionSize, 
+		sizeFreeRegion, freeBlock, currentFreeBlock, currentBlockLinks);
+
+	// Remove allocated block.
+	if (numberFreeBlocks == 1) {
+		freeList = NULL;
+	} else {
+		removeAllocatedBlock(currentBlockLinks);
+	}
+	numberFreeBlocks--;
+
+	// Look for new largestFreeBlock
+	if(numberFreeBlocks && updateLargestFreeBlock) {
+		findAndSetLargestFreeBlock();
+	}
+
+	return freeBlock;
+}
+
 // Check if the new region is big enough to store a new free block.
 // if not do not split, but free list now points to next node.
 void allocateBlock(uint32_t size, uint32_t spaceLeft, 
@@ -395,6 +1011,7 @@ void allocateBlock(uint32_t size, uint32_t spaceLeft,
 	struct freeBlockLinks *currentBlockLinks) 
 {
 	if (spaceLeft > minFreeRegionSize) {
+		TRACE_ALLOCATION_PATH(LATENCY_GET_MEMORY_SPLIT);
 		if (sufficientSize(size)) {
 			freeList = splitFreeBlock(freeBlock, spaceLeft, 
 				size, currentFreeBlock, currentBlockLinks);
@@ -429,6 +1046,9 @@ void allocateBlock(uint32_t size, uint32_t spaceLeft,
 
 void findAndSetLargestFreeBlock() 
 {
+	TRACE_PROBE(find_largest_free_block_start, numberFreeBlocks);
+	TRACE_START(start);
+
 	// traverse free list.
 	largestFreeBlock = 0; // Reset largest free region.
 	int numberTraversedNodes = 0;
@@ -447,6 +1067,9 @@ void findAndSetLargestFreeBlock()
 		numberTraversedNodes++;
 		currentFreeBlock = NEXT_BLOCK(currentBlockLinks);
 	} while (numberTraversedNodes < numberFreeBlocks);
+
+	TRACE_END(LATENCY_FIND_LARGEST_FREE_BLOCK, start);
+	TRACE_PROBE(find_largest_free_block_done, largestFreeBlock);
 }
 
 
@@ -556,6 +1179,7 @@ uint32_t minimumSize()
 
 void coalescingAndFree(void* block) 
 {
+	TRACE_START(start);
 	struct blockHeader *header = INIT_STRUCT(blockHeader, block);
 	uint32_t size = GET_SIZE(header->attribute); // in words
 	uint32_t flag = GET_FLAG(header->attribute);
@@ -661,6 +1285,10 @@ void coalescingAndFree(void* block)
 		largestFreeBlock = newSize;
 
 	freeList = newAddr;
+
+	// Coalescing paths are in the same order as NEIGHBOUR_BLOCKS.
+	TRACE_END(LATENCY_COALESCE_NOT_FREE + state, start);
+	TRACE_PROBE(coalesce, state);
 }
 
 void coalesceWithPrevBlock(void* newAddr, uint32_t newSize) 
@@ -684,6 +1312,13 @@ void coalesceWithNextBlock(void* newAddr, uint32_t newSize, struct freeBlockLink
 	PREV_BLOCK(newBlockLinks) = PREV_BLOCK(successorBlockLinks);
 	NEXT_BLOCK(newBlockLinks) = NEXT_BLOCK(successorBlockLinks);
 
+	// If the successor was the only free block, the new block links to itself.
+	void* successorBlock = ADDRESS_MINUS_OFFSET((void*) successorBlockLinks, blockHeader);
+	if (NEXT_BLOCK(newBlockLinks) == successorBlock) {
+		PREV_BLOCK(newBlockLinks) = newAddr;
+		NEXT_BLOCK(newBlockLinks) = newAddr;
+	}
+
 	// Prev block.
 	void* prevLinks = ADDRESS_PLUS_OFFSET(PREV_BLOCK(newBlockLinks), blockHeader);
 	struct freeBlockLinks *prevBlockLinks = INIT_STRUCT(freeBlockLinks, prevLinks);
@@ -692,7 +1327,7 @@ void coalesceWithNextBlock(void* newAddr, uint32_t newSize, struct freeBlockLink
 	// Next block.
 	void* nextLinks = ADDRESS_PLUS_OFFSET(NEXT_BLOCK(newBlockLinks), blockHeader);
 	struct freeBlockLinks *nextBlockLinks = INIT_STRUCT(freeBlockLinks, nextLinks);
-	PREV_BLOCK(prevBlockLinks) = newAddr;
+	PREV_BLOCK(nextBlockLinks) = newAddr;
 
 	uint64_t sizeOffset = WORDS_TO_BYTES(newSize);
 	setFooterBlockOnCoalescing(newAddr, sizeOffset, newSize);
@@ -712,6 +1347,348 @@ void coalesceWithNeighbours(void* newAddr, uint32_t newSize, struct freeBlockLin
 	numberFreeBlocks--;
 }
 
+// Double the capacity of the handle table.
+// The table itself is a non-relocatable block.
+bool growHandleTable()
+{
+	int newCapacity = handleTableCapacity ? 2 * handleTableCapacity : DEFAULT_NUMBER_HANDLES;
+	struct handleEntry *newHandleTable = getMemory(newCapacity * sizeof(handleEntry));
+	if (!newHandleTable)
+		return false;
+
+	if (handleTable) {
+		memcpy(newHandleTable, handleTable, handleTableCapacity * sizeof(handleEntry));
+		freeMemory(handleTable);
+	}
+
+	// Chain the new entries in the list of free handles.
+	int i;
+	for (i = handleTableCapacity; i < newCapacity; i++) {
+		newHandleTable[i].block = NULL;
+		newHandleTable[i].lockCount = 0;
+		newHandleTable[i].nextFreeHandle = (i + 1 < newCapacity) ? i + 1 : firstFreeHandle;
+	}
+	firstFreeHandle = handleTableCapacity;
+
+	handleTable = newHandleTable;
+	handleTableCapacity = newCapacity;
+	return true;
+}
+
+bool isValidHandle(memoryHandle handle)
+{
+	return handle >= 0 && handle < handleTableCapacity && handleTable[handle].block;
+}
+
+// Move the block of an unlocked handle into a free block at a lower address.
+// Returns false if there is no such free block.
+bool moveHandleBlock(struct handleEntry *entry)
+{
+	void *startBlock = ADDRESS_MINUS_OFFSET(entry->block, blockHeader);
+	struct blockHeader *header = INIT_STRUCT(blockHeader, startBlock);
+	uint32_t size = GET_SIZE(header->attribute); // in words
+
+	void* lowerFreeBlock = findLowerFreeBlock(startBlock, size);
+	if (!lowerFreeBlock)
+		return false;
+
+	void* newBlock = allocateFreeBlock(lowerFreeBlock, size);
+	memcpy(newBlock, entry->block, WORDS_TO_BYTES(size));
+	currentAllocatedMemory += WORDS_TO_BYTES(size); // Balanced by freeMemory.
+	freeMemory(entry->block);
+
+	entry->block = newBlock;
+	return true;
+}
+
+// Find the free block with the lowest address below -block- that can hold
+// -size- words. Returns NULL if there is none.
+void *findLowerFreeBlock(void* block, uint32_t size)
+{
+	if (!freeList)
+		return NULL;
+
+	void* lowestFreeBlock = NULL;
+	int numberTraversedNodes = 0;
+	void* currentFreeBlock = freeList;
+	do {
+		struct blockHeader *currentFreeRegionHeader = INIT_STRUCT(blockHeader, currentFreeBlock);
+		uint32_t sizeFreeRegion = GET_SIZE(currentFreeRegionHeader->attribute);
+		if (currentFreeBlock < block && sizeFreeRegion >= size &&
+			(!lowestFreeBlock || currentFreeBlock < lowestFreeBlock)) {
+			lowestFreeBlock = currentFreeBlock;
+		}
+
+		void* freeBlock = ADDRESS_PLUS_OFFSET(currentFreeBlock, blockHeader);
+		struct freeBlockLinks *currentBlockLinks = INIT_STRUCT(freeBlockLinks, freeBlock);
+
+		numberTraversedNodes++;
+		currentFreeBlock = NEXT_BLOCK(currentBlockLinks);
+	} while (numberTraversedNodes < numberFreeBlocks);
+
+	return lowestFreeBlock;
+}
+
+// Remove a free block from the free list without allocating it.
+void removeFreeBlock(void* block)
+{
+	struct blockHeader *header = INIT_STRUCT(blockHeader, block);
+	uint32_t size = GET_SIZE(header->attribute); // in words
+
+	void* links = ADDRESS_PLUS_OFFSET(block, blockHeader);
+	struct freeBlockLinks *blockLinks = INIT_STRUCT(freeBlockLinks, links);
+	if (numberFreeBlocks == 1) {
+		freeList = NULL;
+	} else {
+		if (freeList == block)
+			freeList = NEXT_BLOCK(blockLinks);
+		removeAllocatedBlock(blockLinks);
+	}
+	numberFreeBlocks--;
+
+	totalFreeSpace -= WORDS_TO_BYTES(size); // Stats
+	if (numberFreeBlocks)
+		findAndSetLargestFreeBlock();
+	else
+		largestFreeBlock = 0;
+}
+
+bool isInFreeList(void* block)
+{
+	if (!freeList)
+		return false;
+
+	int numberTraversedNodes = 0;
+	void* currentFreeBlock = freeList;
+	do {
+		if (currentFreeBlock == block)
+			return true;
+
+		void* freeBlock = ADDRESS_PLUS_OFFSET(currentFreeBlock, blockHeader);
+		struct freeBlockLinks *currentBlockLinks = INIT_STRUCT(freeBlockLinks, freeBlock);
+
+		numberTraversedNodes++;
+		currentFreeBlock = NEXT_BLOCK(currentBlockLinks);
+	} while (numberTraversedNodes < numberFreeBlocks);
+
+	return false;
+}
+
+// Unmap the free pages at the end of a mmap region.
+// If the whole region is free, unmap it, remove it from the mmaps list and return true.
+bool trimMmapRegion(void* mmapRegion, void* prevMmapRegion)
+{
+	struct headerMmapRegion *headerMmap = INIT_STRUCT(headerMmapRegion, mmapRegion);
+	uint64_t length = WORDS_TO_BYTES(headerMmap->length);
+	void* footer = ADDRESS_MINUS_OFFSET((mmapRegion + length), blockHeader);
+	struct blockHeader *footerMmap = INIT_STRUCT(blockHeader, footer);
+
+	// Is the last block of the region free?
+	uint32_t flag = GET_FLAG(footerMmap->attribute);
+	if (flag != MSB_TO_ONE)
+		return false;
+
+	void* previous = ADDRESS_MINUS_OFFSET(footer, freeBlockFooter);
+	struct freeBlockFooter *lastBlockFooter = INIT_STRUCT(freeBlockFooter, previous);
+	uint32_t sizeLastBlock = lastBlockFooter->size; // in words
+	uint64_t sizeOffset = WORDS_TO_BYTES(sizeLastBlock);
+	void* firstBlock = ADDRESS_PLUS_OFFSET(mmapRegion, headerMmapRegion);
+	if (sizeOffset + sizeof(blockHeader) > (uint64_t) (footer - firstBlock))
+		return false;
+
+	// Do not trust the footer alone: the block must be a free block
+	// whose header matches its footer.
+	void* lastBlock = footer - sizeOffset - sizeof(blockHeader);
+	struct blockHeader *lastBlockHeader = INIT_STRUCT(blockHeader, lastBlock);
+	uint32_t sizeLastBlockHeader = GET_SIZE(lastBlockHeader->attribute);
+	if (sizeLastBlockHeader != sizeLastBlock || !isInFreeList(lastBlock))
+		return false;
+
+	if (lastBlock == firstBlock) {
+		removeFreeBlock(lastBlock);
+		if (prevMmapRegion) {
+			struct headerMmapRegion *prevHeaderMmap = INIT_STRUCT(headerMmapRegion, prevMmapRegion);
+			NEXT_MMAP_ADDRESS(prevHeaderMmap) = NEXT_MMAP_ADDRESS(headerMmap);
+		} else {
+			mmapsList = NEXT_MMAP_ADDRESS(headerMmap);
+		}
+		munmap(mmapRegion, length);
+		totalMappedMemory -= length; // Stats
+		return true;
+	}
+
+	// Keep a minimum size free block and the mmap footer, up to the next page.
+	uint64_t pageSize = sysconf(_SC_PAGE_SIZE);
+	uint64_t keptLength = (lastBlock - mmapRegion) + sizeof(blockHeader) + 
+		WORDS_TO_BYTES(minimumSize()) + sizeof(blockHeader);
+	keptLength = ((keptLength + pageSize - 1) / pageSize) * pageSize;
+	if (keptLength >= length)
+		return false;
+
+	munmap(mmapRegion + keptLength, length - keptLength);
+	totalMappedMemory -= length - keptLength; // Stats
+	headerMmap->length = BYTES_TO_WORDS(keptLength);
+	setMmapFooter(mmapRegion, keptLength);
+
+	// Shrink the last free block.
+	void* newFooter = ADDRESS_MINUS_OFFSET((mmapRegion + keptLength), blockHeader);
+	void* usableArea = ADDRESS_PLUS_OFFSET(lastBlock, blockHeader);
+	uint64_t newSizeInBytes = newFooter - usableArea;
+	uint32_t newSize = BYTES_TO_WORDS(newSizeInBytes);
+	flag = GET_FLAG(lastBlockHeader->attribute);
+	lastBlockHeader->attribute = newSize | flag;
+	setFooterBlockOnCoalescing(lastBlock, WORDS_TO_BYTES(newSize), newSize);
+
+	totalFreeSpace -= WORDS_TO_BYTES(sizeLastBlock) - WORDS_TO_BYTES(newSize); // Stats
+	findAndSetLargestFreeBlock();
+	return false;
+}
+
+// Walk all the blocks of the persistent heap region, check that they chain
+// exactly up to the mmap footer and rebuild the free list and the stats.
+// length in bytes
+bool recoverPersistentHeap(uint64_t length)
+{
+	struct headerMmapRegion *headerMmap = INIT_STRUCT(headerMmapRegion, mmapsList);
+	uint64_t regionLength = WORDS_TO_BYTES(headerMmap->length);
+	if (NEXT_MMAP_ADDRESS(headerMmap) != NULL || regionLength != length)
+		return false;
+
+	void* footer = ADDRESS_MINUS_OFFSET((mmapsList + length), blockHeader);
+	struct blockHeader *footerMmap = INIT_STRUCT(blockHeader, footer);
+	uint32_t footerSize = GET_SIZE(footerMmap->attribute);
+	if (footerSize != 0)
+		return false;
+
+	freeList = NULL;
+	numberFreeBlocks = 0;
+	totalFreeSpace = 0;
+	largestFreeBlock = 0;
+	currentAllocatedMemory = 0;
+
+	void* lastFreeBlock = NULL;
+	void* currentBlock = ADDRESS_PLUS_OFFSET(mmapsList, headerMmapRegion);
+	while (currentBlock < footer) {
+		struct blockHeader *header = INIT_STRUCT(blockHeader, currentBlock);
+		uint32_t size = GET_SIZE(header->attribute); // in words
+		uint64_t sizeOffset = WORDS_TO_BYTES(size);
+		void* nextBlock = ADDRESS_PLUS_OFFSET(currentBlock + sizeOffset, blockHeader);
+		if (size == 0 || nextBlock > footer)
+			return false;
+
+		// The flag of the next block tells if this one is free.
+		struct blockHeader *nextHeader = INIT_STRUCT(blockHeader, nextBlock);
+		uint32_t flag = GET_FLAG(nextHeader->attribute);
+		if (flag != MSB_TO_ONE) {
+			currentAllocatedMemory += sizeOffset;
+			currentBlock = nextBlock;
+			continue;
+		}
+
+		void* footerBlock = ADDRESS_MINUS_OFFSET(nextBlock, freeBlockFooter);
+		struct freeBlockFooter *blockFooter = INIT_STRUCT(freeBlockFooter, footerBlock);
+		if (blockFooter->size != size)
+			return false;
+
+		// Append to the free list, in address order.
+		void* links = ADDRESS_PLUS_OFFSET(currentBlock, blockHeader);
+		struct freeBlockLinks *blockLinks = INIT_STRUCT(freeBlockLinks, links);
+		if (!freeList) {
+			freeList = currentBlock;
+		} else {
+			void* lastLinks = ADDRESS_PLUS_OFFSET(lastFreeBlock, blockHeader);
+			struct freeBlockLinks *lastBlockLinks = INIT_STRUCT(freeBlockLinks, lastLinks);
+			NEXT_BLOCK(lastBlockLinks) = currentBlock;
+		}
+		PREV_BLOCK(blockLinks) = lastFreeBlock;
+		lastFreeBlock = currentBlock;
+
+		numberFreeBlocks++;
+		totalFreeSpace += sizeOffset; // Stats
+		if (sizeOffset > largestFreeBlock)
+			largestFreeBlock = sizeOffset;
+
+		currentBlock = nextBlock;
+	}
+
+	if (currentBlock != footer)
+		return false;
+
+	// Close the circular list.
+	if (freeList) {
+		void* firstLinks = ADDRESS_PLUS_OFFSET(freeList, blockHeader);
+		struct freeBlockLinks *firstBlockLinks = INIT_STRUCT(freeBlockLinks, firstLinks);
+		void* lastLinks = ADDRESS_PLUS_OFFSET(lastFreeBlock, blockHeader);
+		struct freeBlockLinks *lastBlockLinks = INIT_STRUCT(freeBlockLinks, lastLinks);
+		PREV_BLOCK(firstBlockLinks) = lastFreeBlock;
+		NEXT_BLOCK(lastBlockLinks) = freeList;
+	}
+
+	return true;
+}
+
+// Copy the allocator state into the persistent heap header.
+void savePersistentHeapState()
+{
+	persistentHeap->freeList = freeList;
+	persistentHeap->numberFreeBlocks = numberFreeBlocks;
+	persistentHeap->totalFreeSpace = totalFreeSpace;
+	persistentHeap->largestFreeBlock = largestFreeBlock;
+	persistentHeap->currentAllocatedMemory = currentAllocatedMemory;
+}
+
+// Forget all blocks, as if no memory had been allocated.
+// There are no handles, they cannot be allocated in a persistent heap.
+void resetHeapState()
+{
+	freeList = NULL;
+	mmapsList = NULL;
+	numberFreeBlocks = 0;
+	totalFreeSpace = 0;
+	largestFreeBlock = 0;
+	currentAllocatedMemory = 0;
+	thereIsAnMmapRegion = 0;
+}
+
+void getLatencyHistogram(LATENCY_PATH path, uint64_t buckets[NUMBER_LATENCY_BUCKETS])
+{
+#ifdef LIGHT_MALLOC_TRACE
+	if (path >= 0 && path < NUMBER_LATENCY_PATHS) {
+		memcpy(buckets, latencyHistograms[path], sizeof(latencyHistograms[path]));
+		return;
+	}
+#endif
+	memset(buckets, 0, NUMBER_LATENCY_BUCKETS * sizeof(uint64_t));
+}
+
+void resetLatencyHistograms()
+{
+#ifdef LIGHT_MALLOC_TRACE
+	memset(latencyHistograms, 0, sizeof(latencyHistograms));
+#endif
+}
+
+#ifdef LIGHT_MALLOC_TRACE
+// Monotonic time in nanoseconds.
+uint64_t traceClock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// latency in nanoseconds
+void recordLatency(LATENCY_PATH path, uint64_t latency)
+{
+	int bucket = 0;
+	while (latency > 1 && bucket < NUMBER_LATENCY_BUCKETS - 1) {
+		latency >>= 1;
+		bucket++;
+	}
+	latencyHistograms[path][bucket]++;
+}
+#endif
+
 void setFooterBlockOnCoalescing(void* newAddr, uint64_t sizeOffset, uint32_t newSize) 
 {
 	// Footer
@@ -11,7 +11,8 @@
  *			of a given size in bytes.
  *
  * @param	[in] size	The number of bytes to be allocated
- * @returns	[out] 		The allocated memory	
+ * @returns	[out] 		The allocated memory, NULL if size is out of
+ *						bounds or the memory cannot be mapped.
  */
 extern void *getMemory(int size);
 
@@ -23,6 +24,260 @@ extern void *getMemory(int size);
 */
 extern void freeMemory(void *ptr);
 
+/**
+ * @brief	getMemoryWithSize behaves like \c #getMemory() but also
+ *			reports the number of bytes actually usable in the
+ *			returned chunk, which may exceed the requested size.
+ *
+ * @param	[in] size			The number of bytes to be allocated
+ * @param	[out] usableSize	Set to the usable size of the chunk.
+ *								Can be NULL.
+ * @returns	[out] 				The allocated memory
+ */
+extern void *getMemoryWithSize(int size, int *usableSize);
+
+/**
+ * @brief	getUsableSize returns the number of bytes that can be
+ *			used in a chunk previously allocated using \c #getMemory()
+ *
+ * @param	[in] ptr	The allocated memory.
+ * @returns	[out]		The usable size in bytes, 0 if ptr is NULL.
+ */
+extern int getUsableSize(void *ptr);
+
+/**
+ * @brief	goodSize returns the size, in bytes, that Light-Malloc
+ *			would hand out for a request of the given size.
+ *			Containers can use it to grow to a size without slack.
+ *			The returned chunk might still be larger if the
+ *			remaining free space is too small to be split.
+ *
+ * @param	[in] size	The number of bytes to be allocated
+ * @returns	[out]		The rounded size in bytes, 0 if out of bounds.
+ */
+extern int goodSize(int size);
+
+/**
+ * Flags for \c #reserveMemory()
+ * RESERVE_MEMORY_POPULATE asks the kernel to populate the pages
+ * when mapping them (MAP_POPULATE), RESERVE_MEMORY_TOUCH faults
+ * them in by touching every page.
+ */
+#define RESERVE_MEMORY_POPULATE 1
+#define RESERVE_MEMORY_TOUCH 2
+
+/**
+ * @brief	reserveMemory maps a region of the given size up front,
+ *			so that the first calls to \c #getMemory() do not have
+ *			to mmap memory or take page faults.
+ *
+ * @param	[in] size	The number of bytes to be reserved
+ * @param	[in] flags	A combination of the RESERVE_MEMORY_* flags,
+ *						0 to let the pages be faulted in lazily.
+ * @returns	[out]		0 on success, -1 if size is out of bounds
+ *						(about 2GB at most) or the memory cannot be mapped.
+ */
+extern int reserveMemory(uint64_t size, int flags);
+
+/**
+ * memoryHandle identifies a relocatable chunk of memory allocated
+ * using \c #allocHandle(). Light-Malloc may move the chunk while
+ * it is unlocked, so its address is only valid between
+ * \c #lockHandle() and \c #unlockHandle().
+ */
+typedef int memoryHandle;
+#define INVALID_MEMORY_HANDLE -1
+
+/**
+ * @brief	allocHandle allocates a relocatable chunk of memory
+ *			of a given size in bytes.
+ *
+ * @param	[in] size	The number of bytes to be allocated
+ * @returns	[out]		The handle, INVALID_MEMORY_HANDLE on failure
+ *						or while a persistent heap is open.
+ */
+extern memoryHandle allocHandle(int size);
+
+/**
+ * @brief	lockHandle pins a chunk allocated using \c #allocHandle()
+ *			and returns its current address. Locks nest.
+ *
+ * @param	[in] handle	The handle to be locked.
+ * @returns	[out]		The address of the chunk, NULL if invalid.
+ */
+extern void *lockHandle(memoryHandle handle);
+
+/**
+* @brief	unlockHandle releases a lock taken with \c #lockHandle()
+*			The chunk can be moved once all its locks are released.
+*
+* @param	[in] handle	The handle to be unlocked.
+*/
+extern void unlockHandle(memoryHandle handle);
+
+/**
+* @brief	freeHandle deallocates a chunk previously allocated
+*			using \c #allocHandle() The chunk must not be locked.
+*
+* @param	[in] handle	The handle to be freed.
+*/
+extern void freeHandle(memoryHandle handle);
+
+/**
+ * @brief	compactMemory moves up to maxMoves unlocked handle chunks
+ *			into free blocks at lower addresses, then releases the
+ *			free tails of the mmap regions through \c #trimMemory().
+ *			Successive calls resume where the previous one stopped.
+ *
+ * @param	[in] maxMoves	The maximum number of chunks to move.
+ * @returns	[out]			The number of chunks moved.
+ */
+extern int compactMemory(int maxMoves);
+
+/**
+ * @brief	trimMemory unmaps the free pages at the end of each
+ *			mmap region, and the regions that are entirely free.
+ */
+extern void trimMemory(void);
+
+/**
+ * memoryPressureCallback is called when Light-Malloc is about to map
+ * memory beyond the soft limit set with \c #setMemoryLimits().
+ * The callback should free memory it can do without, e.g. cache entries.
+ *
+ * @param	[in] mappedMemory	The value of \c #totalMappedMemory
+ * @param	[in] context		The context given on registration.
+ */
+typedef void (*memoryPressureCallback)(uint64_t mappedMemory, void* context);
+
+/**
+ * @brief	setMemoryLimits sets limits, in bytes, on the memory mapped
+ *			by Light-Malloc. Mapping memory beyond the soft limit first
+ *			trims the mmap regions and calls the registered pressure
+ *			callbacks. Allocations that would map memory beyond the hard
+ *			limit return NULL. A limit of 0 disables it.
+ *			\c #reserveMemory() is an explicit request and does not
+ *			notify the callbacks, but it respects the hard limit.
+ *
+ * @param	[in] softLimit	The soft limit in bytes.
+ * @param	[in] hardLimit	The hard limit in bytes.
+ */
+extern void setMemoryLimits(uint64_t softLimit, uint64_t hardLimit);
+
+/**
+ * @brief	registerPressureCallback registers a callback to be called
+ *			when the soft limit is crossed. At most 8 callbacks can be
+ *			registered.
+ *
+ * @param	[in] callback	The callback.
+ * @param	[in] context	Passed back to the callback.
+ * @returns	[out]			0 on success, -1 otherwise.
+ */
+extern int registerPressureCallback(memoryPressureCallback callback, void* context);
+
+/**
+ * Errors returned by \c #openPersistentHeap()
+ */
+#define PERSISTENT_HEAP_ERROR -1
+#define PERSISTENT_HEAP_ADDRESS_IN_USE -2
+
+/**
+ * @brief	openPersistentHeap backs Light-Malloc with a memory-mapped file,
+ *			so that the allocated memory outlives the process. If the file
+ *			is empty, a new heap of the given size is created. Otherwise the
+ *			heap is mapped back at the address it had when it was created,
+ *			so blocks and the pointers stored in them are restored without
+ *			copying. A heap that was not closed is checked and its free list
+ *			rebuilt. Only one process can open the heap at a time.
+ *			Links between blocks are absolute pointers, so the heap cannot
+ *			be moved: if another mapping, e.g. a library placed by address
+ *			space randomization, already occupies its address, opening fails
+ *			with PERSISTENT_HEAP_ADDRESS_IN_USE. The caller can retry from a
+ *			fresh process, or open the heap before mapping anything else.
+ *			Must be called before any other allocation. While the
+ *			heap is open, \c #getMemory() allocates from it only and
+ *			returns NULL once it is full. Handles are not persisted, so
+ *			\c #allocHandle() fails while the heap is open.
+ *
+ * @param	[in] path	The path of the heap file.
+ * @param	[in] size	The size in bytes of a new heap. Ignored if the
+ *						file already holds a heap.
+ * @returns	[out]		0 on success, PERSISTENT_HEAP_ADDRESS_IN_USE if the
+ *						heap address is taken, PERSISTENT_HEAP_ERROR otherwise.
+ */
+extern int openPersistentHeap(const char* path, uint64_t size);
+
+/**
+ * @brief	syncPersistentHeap writes the persistent heap to its file.
+ */
+extern void syncPersistentHeap(void);
+
+/**
+ * @brief	closePersistentHeap writes the persistent heap to its file,
+ *			marks it as cleanly closed and unmaps it. All the memory it
+ *			holds becomes invalid.
+ */
+extern void closePersistentHeap(void);
+
+/**
+ * @brief	setPersistentRoot records a pointer into the persistent heap,
+ *			typically the root of the application data, so that it can be
+ *			found again with \c #getPersistentRoot() after a restart.
+ *
+ * @param	[in] ptr	The pointer to be recorded.
+ */
+extern void setPersistentRoot(void* ptr);
+
+/**
+ * @brief	getPersistentRoot returns the pointer recorded with
+ *			\c #setPersistentRoot()
+ *
+ * @returns	[out]	The recorded pointer, NULL if no heap is open.
+ */
+extern void *getPersistentRoot(void);
+
+/**
+ * LATENCY_PATH identifies a latency histogram: either a whole operation,
+ * the path an allocation took, or an internal step of the allocator.
+ */
+typedef enum
+{
+	LATENCY_GET_MEMORY,					// getMemory()
+	LATENCY_GET_MEMORY_FAST_HIT,		// getMemory() using a whole free block
+	LATENCY_GET_MEMORY_SPLIT,			// getMemory() splitting a free block
+	LATENCY_GET_MEMORY_NEW_MMAP,		// getMemory() mapping a new region
+	LATENCY_FREE_MEMORY,				// freeMemory()
+	LATENCY_COALESCE_NOT_FREE,			// freeMemory() with no free neighbour
+	LATENCY_COALESCE_PRECEDENT_FREE,	// freeMemory() merging with the previous block
+	LATENCY_COALESCE_SUCCESSIVE_FREE,	// freeMemory() merging with the next block
+	LATENCY_COALESCE_BOTH_FREE,			// freeMemory() merging with both neighbours
+	LATENCY_GET_FREE_BLOCK,				// Walk of the free list
+	LATENCY_FIND_LARGEST_FREE_BLOCK,	// Rescan for largestFreeBlock
+	LATENCY_MMAP_REGION,				// mmap system call
+	NUMBER_LATENCY_PATHS
+} LATENCY_PATH;
+
+#define NUMBER_LATENCY_BUCKETS 32
+
+/**
+ * @brief	getLatencyHistogram copies the latency histogram of a path.
+ *			Bucket i counts the latencies in [2^i, 2^(i+1)) nanoseconds,
+ *			the last bucket also counts all longer ones.
+ *			Histograms are only recorded if Light-Malloc is compiled with
+ *			LIGHT_MALLOC_TRACE, otherwise all buckets are 0.
+ *			Compiling with LIGHT_MALLOC_USDT adds static tracepoints
+ *			(provider lightmalloc) on the same paths.
+ *
+ * @param	[in] path		The histogram to be read.
+ * @param	[out] buckets	Set to the counts of the histogram.
+ */
+extern void getLatencyHistogram(LATENCY_PATH path, uint64_t buckets[NUMBER_LATENCY_BUCKETS]);
+
+/**
+ * @brief	resetLatencyHistograms sets all the latency histograms to 0.
+ */
+extern void resetLatencyHistograms(void);
+
 // Statistical variables
 
 /**
@@ -49,3 +304,9 @@ extern int largestFreeBlock;
 * that Light-Malloc has allocated through \c #getMemory()
 */
 extern int currentAllocatedMemory;
+
+/**
+* totalMappedMemory is the total amount of space, in bytes,
+* that Light-Malloc has mapped.
+*/
+extern uint64_t totalMappedMemory;
@@ -0,0 +1,129 @@
+/**
+* The following code is under GNU License.
+* See attached License file or visit:
+* https://gnu.org/licenses/gpl.html
+*/
+
+/**
+ * Compaction of relocatable handles.
+ * Handles of mixed sizes are allocated over several mmap regions and
+ * most of them are freed. Compaction must move the remaining chunks
+ * without changing their content, keep locked chunks in place, and
+ * unmap the memory it frees.
+ *
+ * Build and run from the repository root:
+ *	gcc -Isrc test/compactionTest.c src/memoryManagement.c -lm -o compactionTest
+ *	./compactionTest
+ */
+
+#include <stdio.h>
+#include "memoryManagement.h"
+
+#define NUMBER_HANDLES 4000
+
+static memoryHandle handles[NUMBER_HANDLES];
+
+// Sizes from 1 byte to a few pages, including sizes below the minimum block.
+static int handleSize(int i)
+{
+	static const int sizes[] = {1, 8, 20, 21, 100, 1000, 3000, 5000};
+	return sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static void fillHandle(int i)
+{
+	unsigned char* data = lockHandle(handles[i]);
+	int j;
+	for (j = 0; j < handleSize(i); j++)
+		data[j] = (i + j) & 0xff;
+	unlockHandle(handles[i]);
+}
+
+static int checkHandle(int i)
+{
+	unsigned char* data = lockHandle(handles[i]);
+	int j;
+	for (j = 0; j < handleSize(i); j++) {
+		if (data[j] != ((i + j) & 0xff)) {
+			unlockHandle(handles[i]);
+			return 1;
+		}
+	}
+	unlockHandle(handles[i]);
+	return 0;
+}
+
+int main()
+{
+	int i;
+	for (i = 0; i < NUMBER_HANDLES; i++) {
+		handles[i] = allocHandle(handleSize(i));
+		if (handles[i] == INVALID_MEMORY_HANDLE) {
+			fprintf(stderr, "compactionTest - Cannot allocate handle\n");
+			return 1;
+		}
+		fillHandle(i);
+	}
+
+	// Keep one handle in 8, spread over all the regions.
+	for (i = 0; i < NUMBER_HANDLES; i++) {
+		if (i % 8) {
+			freeHandle(handles[i]);
+			handles[i] = INVALID_MEMORY_HANDLE;
+		}
+	}
+
+	// A locked chunk can neither be freed nor moved.
+	void* locked = lockHandle(handles[NUMBER_HANDLES - 8]);
+	freeHandle(handles[NUMBER_HANDLES - 8]);
+	if (!lockHandle(handles[NUMBER_HANDLES - 8])) {
+		fprintf(stderr, "compactionTest - Locked handle freed\n");
+		return 1;
+	}
+	unlockHandle(handles[NUMBER_HANDLES - 8]);
+
+	uint64_t mappedBeforeCompaction = totalMappedMemory;
+	int numberMovedChunks = 0;
+	int numberMoves;
+	while ((numberMoves = compactMemory(64)) > 0)
+		numberMovedChunks += numberMoves;
+
+	if (lockHandle(handles[NUMBER_HANDLES - 8]) != locked) {
+		fprintf(stderr, "compactionTest - Locked handle moved\n");
+		return 1;
+	}
+	unlockHandle(handles[NUMBER_HANDLES - 8]);
+	unlockHandle(handles[NUMBER_HANDLES - 8]);
+
+	for (i = 0; i < NUMBER_HANDLES; i += 8) {
+		if (checkHandle(i)) {
+			fprintf(stderr, "compactionTest - Handle %d corrupted by compaction\n", i);
+			return 1;
+		}
+	}
+
+	if (!numberMovedChunks || totalMappedMemory >= mappedBeforeCompaction) {
+		fprintf(stderr, "compactionTest - Compaction released no memory\n");
+		return 1;
+	}
+
+	// The compacted heap must still be usable.
+	for (i = 1; i < NUMBER_HANDLES; i += 8) {
+		handles[i] = allocHandle(handleSize(i));
+		if (handles[i] == INVALID_MEMORY_HANDLE) {
+			fprintf(stderr, "compactionTest - Cannot allocate after compaction\n");
+			return 1;
+		}
+		fillHandle(i);
+	}
+	for (i = 0; i < NUMBER_HANDLES; i++) {
+		if (handles[i] != INVALID_MEMORY_HANDLE && checkHandle(i)) {
+			fprintf(stderr, "compactionTest - Handle %d corrupted\n", i);
+			return 1;
+		}
+	}
+
+	printf("compactionTest - OK (%d moves, %lu -> %lu bytes mapped)\n", numberMovedChunks,
+		(unsigned long) mappedBeforeCompaction, (unsigned long) totalMappedMemory);
+	return 0;
+}
@@ -0,0 +1,209 @@
+/**
+* The following code is under GNU License.
+* See attached License file or visit:
+* https://gnu.org/licenses/gpl.html
+*/
+
+/**
+ * Crash and recovery of a persistent heap.
+ * A process fills a new heap with blocks of mixed sizes, syncs it and
+ * exits without closing it. A new process, with its own address space
+ * layout, then reopens the heap, which must be recovered with all the
+ * blocks intact at their original addresses. The same is done with a
+ * heap filled up completely, where a single block is then freed.
+ * Each step runs in a fresh process executing this program again.
+ *
+ * Build and run from the repository root:
+ *	gcc -Isrc test/persistentHeapTest.c src/memoryManagement.c -lm -o persistentHeapTest
+ *	./persistentHeapTest
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "memoryManagement.h"
+
+#define HEAP_PATH "/tmp/lightMallocPersistentHeapTest.bin"
+#define FULL_HEAP_PATH "/tmp/lightMallocPersistentHeapTestFull.bin"
+#define HEAP_SIZE (8 << 20)
+#define NUMBER_RECORDS 2000
+
+struct record {
+	struct record* next;
+	int size;
+	unsigned char* data;
+};
+
+// Sizes from 1 byte to a few pages, including sizes below the minimum block.
+static int recordSize(int i)
+{
+	static const int sizes[] = {1, 4, 8, 13, 20, 21, 64, 100, 1000, 4096, 9000};
+	return sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static void fillHeap()
+{
+	if (openPersistentHeap(HEAP_PATH, HEAP_SIZE)) {
+		_exit(1);
+	}
+
+	struct record* head = NULL;
+	int i;
+	for (i = 0; i < NUMBER_RECORDS; i++) {
+		struct record* record = getMemory(sizeof(struct record));
+		record->size = recordSize(i);
+		record->data = getMemory(record->size);
+		memset(record->data, i & 0xff, record->size);
+
+		// Leave free blocks of all sizes between the records.
+		void* hole = getMemory(recordSize(i + 3));
+		if (i % 2)
+			freeMemory(hole);
+
+		record->next = head;
+		head = record;
+	}
+	setPersistentRoot(head);
+
+	// Crash after the data reached the file.
+	syncPersistentHeap();
+	_exit(0);
+}
+
+// Fill a heap until no block is left, then free a single block.
+static void fillHeapCompletely()
+{
+	if (openPersistentHeap(FULL_HEAP_PATH, 1 << 20)) {
+		_exit(1);
+	}
+
+	void* block = getMemory(200);
+	while (getMemory(200))
+		;
+	while (getMemory(1))
+		;
+	if (numberFreeBlocks)
+		_exit(1);
+
+	freeMemory(block);
+	syncPersistentHeap();
+	_exit(0);
+}
+
+static int checkHeap()
+{
+	int i = NUMBER_RECORDS - 1;
+	struct record* record = getPersistentRoot();
+	for (; record; record = record->next, i--) {
+		int j;
+		if (record->size != recordSize(i))
+			return 1;
+		for (j = 0; j < record->size; j++) {
+			if (record->data[j] != (i & 0xff))
+				return 1;
+		}
+	}
+	return i == -1 ? 0 : 1;
+}
+
+// The heap that was not closed must be recovered with its data.
+static int recoverHeap()
+{
+	if (openPersistentHeap(HEAP_PATH, HEAP_SIZE) || checkHeap()) {
+		fprintf(stderr, "persistentHeapTest - Heap not recovered\n");
+		return 1;
+	}
+
+	// The recovered free list must be usable.
+	int i;
+	for (i = 0; i < NUMBER_RECORDS; i++) {
+		if (!getMemory(recordSize(i))) {
+			fprintf(stderr, "persistentHeapTest - Cannot allocate after recovery\n");
+			return 1;
+		}
+	}
+	closePersistentHeap();
+
+	// Reopen the cleanly closed heap.
+	if (openPersistentHeap(HEAP_PATH, HEAP_SIZE) || checkHeap()) {
+		fprintf(stderr, "persistentHeapTest - Heap not reopened\n");
+		return 1;
+	}
+	uint64_t pageSize = sysconf(_SC_PAGE_SIZE);
+	void* heapPage = (void*) (((uint64_t) getPersistentRoot() / pageSize) * pageSize);
+	closePersistentHeap();
+
+	// The heap cannot be opened while its address is taken.
+	void* mapping = mmap(heapPage, pageSize, PROT_READ, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0);
+	if (mapping == MAP_FAILED ||
+		openPersistentHeap(HEAP_PATH, HEAP_SIZE) != PERSISTENT_HEAP_ADDRESS_IN_USE) {
+		fprintf(stderr, "persistentHeapTest - Heap opened at a taken address\n");
+		return 1;
+	}
+	munmap(mapping, pageSize);
+
+	if (openPersistentHeap(HEAP_PATH, HEAP_SIZE) || checkHeap()) {
+		fprintf(stderr, "persistentHeapTest - Heap not reopened once its address is free\n");
+		return 1;
+	}
+	closePersistentHeap();
+	return 0;
+}
+
+// The single free block of a full heap must be recovered.
+static int recoverFullHeap()
+{
+	if (openPersistentHeap(FULL_HEAP_PATH, 1 << 20) || numberFreeBlocks != 1 || !getMemory(100)) {
+		fprintf(stderr, "persistentHeapTest - Free block of full heap not recovered\n");
+		return 1;
+	}
+	closePersistentHeap();
+	return 0;
+}
+
+// Run a step of the test in a new process.
+static int runStep(char* program, char* step)
+{
+	pid_t child = fork();
+	if (child == 0) {
+		execl(program, program, step, (char*) NULL);
+		_exit(1);
+	}
+
+	int status;
+	waitpid(child, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "persistentHeapTest - Step %s failed\n", step);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1) {
+		if (!strcmp(argv[1], "fill"))
+			fillHeap();
+		if (!strcmp(argv[1], "fillCompletely"))
+			fillHeapCompletely();
+		if (!strcmp(argv[1], "recover"))
+			return recoverHeap();
+		if (!strcmp(argv[1], "recoverCompletely"))
+			return recoverFullHeap();
+		return 1;
+	}
+
+	unlink(HEAP_PATH);
+	unlink(FULL_HEAP_PATH);
+	int failed = runStep(argv[0], "fill") || runStep(argv[0], "recover") ||
+		runStep(argv[0], "fillCompletely") || runStep(argv[0], "recoverCompletely");
+	unlink(HEAP_PATH);
+	unlink(FULL_HEAP_PATH);
+	if (failed)
+		return 1;
+
+	printf("persistentHeapTest - OK\n");
+	return 0;
+}